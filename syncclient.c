@@ -1,13 +1,76 @@
+#define _GNU_SOURCE  // nftw
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ftw.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
 
 #define BUFFER_SIZE 1024
 #define PATH_MAX 1024
+#define MAX_SUBSCRIPTIONS 32
+
+int remove_entry(const char *path, const struct stat *path_stat, int type, struct FTW *ftw) {
+    (void)path_stat;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+// Remove a directory and everything below it
+int remove_tree(const char *path) {
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// A path from the server is only used if it stays inside client_sync_dir:
+// not empty, not absolute and without ".." components
+int is_safe_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') {
+        return 0;
+    }
+    for (const char *component = path; *component; ) {
+        size_t len = strcspn(component, "/");
+        if (len == 2 && strncmp(component, "..", 2) == 0) {
+            return 0;
+        }
+        component += len + (component[len] == '/');
+    }
+    return 1;
+}
+
+// Drop empty and "." components of a subscription prefix in place, so "./docs/" becomes "docs".
+// Returns 0 if the prefix contains "..", which would point outside the sync dir.
+int normalize_prefix(char *prefix) {
+    char normalized[PATH_MAX];
+    size_t offset = 0;
+
+    for (const char *component = prefix; *component; ) {
+        size_t len = strcspn(component, "/");
+        if (len == 2 && strncmp(component, "..", 2) == 0) {
+            return 0;
+        }
+        if (len > 0 && !(len == 1 && component[0] == '.')) {
+            if (offset > 0) {
+                normalized[offset++] = '/';
+            }
+            memcpy(normalized + offset, component, len);
+            offset += len;
+        }
+        component += len + (component[len] == '/');
+    }
+
+    normalized[offset] = '\0';
+    strcpy(prefix, normalized);
+    return 1;
+}
 
 void combine_paths(const char *base_path, const char *relative_path, char *result) {
     result[0] = '\0';
@@ -20,46 +83,170 @@ void combine_paths(const char *base_path, const char *relative_path, char *resul
     strcat(result, relative_path);
 }
 
-// Function to send the entire ignore list file contents as a single message
-void send_ignore_list(int sock, const char *ignore_list_path) {
-    FILE *file = fopen(ignore_list_path, "r");
+// Append the lines of a list file to message as comma-separated entries, returns the new length
+size_t append_list_file(char *message, size_t offset, const char *list_path) {
+    FILE *file = fopen(list_path, "r");
     if (!file) {
-        perror("[CLIENT ERROR] Failed to open ignore list file");
-        return;
+        perror("[CLIENT ERROR] Failed to open list file");
+        return offset;
     }
 
-    char ignore_data[BUFFER_SIZE] = "IGNORE$";  // Start message with "IGNORE$"
-    size_t offset = strlen(ignore_data);
-    
+    size_t start = offset;
     char line[256];
     while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = ',';  // Replace newline with comma for a list format
+        line[strcspn(line, "\r\n")] = '\0';
         size_t len = strlen(line);
+        if (len == 0) {
+            continue;
+        }
 
         // Ensure we don't overflow the buffer
-        if (offset + len >= BUFFER_SIZE - 1) {
+        if (offset + len + 1 >= BUFFER_SIZE - 1) {
             break;
         }
 
-        strcpy(ignore_data + offset, line);
+        if (offset > start) {
+            message[offset++] = ',';
+        }
+        strcpy(message + offset, line);
         offset += len;
     }
 
     fclose(file);
+    return offset;
+}
+
+// Read the subscription prefixes from a list file, one per line, normalized.
+// Invalid prefixes are logged and skipped. Returns the number of prefixes, or -1 if the file can't be read.
+int load_subscriptions(const char *subscription_list_path, char subscriptions[][PATH_MAX]) {
+    FILE *file = fopen(subscription_list_path, "r");
+    if (!file) {
+        perror("[CLIENT ERROR] Failed to open subscription list file");
+        return -1;
+    }
+
+    int count = 0;
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), file) && count < MAX_SUBSCRIPTIONS) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        if (!normalize_prefix(line)) {
+            printf("[CLIENT ERROR] Rejected subscription prefix: %s\n", line);
+            continue;
+        }
+        strcpy(subscriptions[count++], line);
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Send the ignore list and optional subtree subscriptions as a single handshake message:
+// "IGNORE$ext,...;SUBSCRIBE$prefix,..."
+void send_handshake(int sock, const char *ignore_list_path, char subscriptions[][PATH_MAX], int subscription_count) {
+    char handshake[BUFFER_SIZE] = "IGNORE$";  // Start message with "IGNORE$"
+    size_t offset = append_list_file(handshake, strlen(handshake), ignore_list_path);
+
+    for (int i = 0; i < subscription_count; i++) {
+        const char *separator = i == 0 ? ";SUBSCRIBE$" : ",";
+        size_t len = strlen(separator) + strlen(subscriptions[i]);
+
+        // Ensure we don't overflow the buffer
+        if (offset + len >= BUFFER_SIZE - 1) {
+            printf("[CLIENT ERROR] Subscription list too long, dropped from: %s\n", subscriptions[i]);
+            break;
+        }
+        offset += sprintf(handshake + offset, "%s%s", separator, subscriptions[i]);
+    }
+    handshake[offset] = '\0';
+
+    send(sock, handshake, strlen(handshake), 0);
+    printf("[CLIENT LOG] Handshake sent to server: %s\n", handshake);
+}
+
+// Create a directory and its missing parents. Used for subscribed prefixes, whose parent
+// directories are never sent, and for directories created below a removed parent.
+void create_dirs(const char *client_sync_dir, const char *prefix) {
+    char path[PATH_MAX];
+    combine_paths(client_sync_dir, prefix, path);
+
+    for (char *slash = strchr(path + strlen(client_sync_dir) + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) {
+            *slash = '\0';
+        }
+        if (mkdir(path, 0777) == 0) {
+            printf("[CLIENT LOG] Directory created: %s\n", path);
+        }
+        if (!slash) {
+            break;
+        }
+        *slash = '/';
+    }
+}
+
+// Write the body of a "C$path$size$" frame: first the part that arrived with the header, then
+// the rest read from the socket, so a large body is never parsed as further commands.
+// fp may be NULL to only drain the body. Returns the number of bytes written.
+size_t receive_file_body(int sock, FILE *fp, const char *data, size_t data_len, size_t file_size) {
+    size_t received = data_len < file_size ? data_len : file_size;
+    size_t written = fp ? fwrite(data, 1, received, fp) : 0;
+
+    char chunk[BUFFER_SIZE];
+    while (received < file_size) {
+        size_t remaining = file_size - received;
+        ssize_t bytes_received = recv(sock, chunk, remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE, 0);
+        if (bytes_received <= 0) {
+            break;
+        }
+        received += bytes_received;
+        if (fp) {
+            written += fwrite(chunk, 1, bytes_received, fp);
+        }
+    }
+    return written;
+}
 
-    // Remove the last comma if there are entries
-    if (offset > 7) {
-        ignore_data[offset - 1] = '\0';
+// Receive one frame; a descriptor passed alongside it (local transport) is stored in *fd, otherwise -1
+ssize_t recv_frame(int sock, char *buffer, size_t len, int *fd) {
+    struct iovec iov = { .iov_base = buffer, .iov_len = len };
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t bytes_received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (bytes_received <= 0) {
+        return bytes_received;
     }
 
-    // Send the entire ignore list as one string
-    send(sock, ignore_data, strlen(ignore_data), 0);
-    printf("[CLIENT LOG] Ignore list sent to server: %s\n", ignore_data);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    // A local frame larger than the buffer was cut short, so its contents can't be trusted
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return bytes_received;
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 5) {
-        printf("Usage: %s <server_ip> <server_port> <client_sync_dir> <ignore_list_file>\n", argv[0]);
+        printf("Usage: %s <server_ip|unix:socket_path> <server_port> <client_sync_dir> <ignore_list_file> [subscription_list_file]\n", argv[0]);
         return 1;
     }
 
@@ -67,20 +254,46 @@ int main(int argc, char *argv[]) {
     int server_port = atoi(argv[2]);
     char *client_sync_dir = argv[3];
     char *ignore_list_path = argv[4];
+    char *subscription_list_path = argc > 5 ? argv[5] : NULL;  // Path prefixes to sync, one per line
+
+    // A client that asked for subtrees must never fall back to mirroring the whole sync dir
+    char subscriptions[MAX_SUBSCRIPTIONS][PATH_MAX];
+    int subscription_count = 0;
+    if (subscription_list_path) {
+        subscription_count = load_subscriptions(subscription_list_path, subscriptions);
+        if (subscription_count <= 0) {
+            printf("[CLIENT ERROR] No valid subscription prefix in %s\n", subscription_list_path);
+            return 1;
+        }
+    }
+
+    // Same-host clients connect over the server's Unix domain socket and get file bodies as memfds
+    int local = strncmp(server_ip, "unix:", 5) == 0;
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = local ? socket(AF_UNIX, SOCK_SEQPACKET, 0) : socket(AF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("Socket creation failed");
         return 1;
     }
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    struct sockaddr_storage server_addr;
+    socklen_t addr_len;
+    memset(&server_addr, 0, sizeof(server_addr));
+    if (local) {
+        struct sockaddr_un *local_addr = (struct sockaddr_un *)&server_addr;
+        local_addr->sun_family = AF_UNIX;
+        strncpy(local_addr->sun_path, server_ip + 5, sizeof(local_addr->sun_path) - 1);
+        addr_len = sizeof(*local_addr);
+    } else {
+        struct sockaddr_in *inet_addr = (struct sockaddr_in *)&server_addr;
+        inet_addr->sin_family = AF_INET;
+        inet_addr->sin_port = htons(server_port);
+        inet_pton(AF_INET, server_ip, &inet_addr->sin_addr);
+        addr_len = sizeof(*inet_addr);
+    }
 
     int attempts = 5;
-    while (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && attempts > 0) {
+    while (connect(sock, (struct sockaddr *)&server_addr, addr_len) < 0 && attempts > 0) {
         perror("Connection failed, retrying...");
         sleep(1);
         attempts--;
@@ -92,17 +305,30 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    printf("Connected to server at %s:%d\n", server_ip, server_port);
+    if (local) {
+        printf("Connected to server at %s\n", server_ip);
+    } else {
+        printf("Connected to server at %s:%d\n", server_ip, server_port);
+    }
+
+    // **Send the ignore list and subscriptions as a single string**
+    send_handshake(sock, ignore_list_path, subscriptions, subscription_count);
 
-    // **Send the ignore list as a single string**
-    send_ignore_list(sock, ignore_list_path);
+    for (int i = 0; i < subscription_count; i++) {
+        create_dirs(client_sync_dir, subscriptions[i]);
+    }
 
     // **Keep listening for messages from the server**
     char buffer[BUFFER_SIZE];
     int bytes_received;
+    int body_fd;
 
     while (1) {
-        bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+        bytes_received = recv_frame(sock, buffer, BUFFER_SIZE - 1, &body_fd);
+        if (bytes_received < 0 && errno == EMSGSIZE) {
+            printf("[CLIENT ERROR] Oversized frame from server dropped\n");
+            continue;
+        }
         if (bytes_received <= 0) {
             printf("Server disconnected.\n");
             break;
@@ -113,55 +339,71 @@ int main(int argc, char *argv[]) {
         if (buffer[0] == 'C') {
             char filePath[PATH_MAX];
             int fileSize;
-            
-            // Extract file path and size
-            if (sscanf(buffer, "C$%[^$]$%d$", filePath, &fileSize) < 2) {
+            int headerLen = 0;
+
+            // Extract file path and size, headerLen is where the body starts
+            if (sscanf(buffer, "C$%[^$]$%d$%n", filePath, &fileSize, &headerLen) < 2 || headerLen == 0 || fileSize < 0) {
                 printf("[CLIENT ERROR] Invalid file format: %s\n", buffer);
-                return;
-            }
-        
-            char fullPath[PATH_MAX];
-            combine_paths(client_sync_dir, filePath, fullPath);
-        
-            printf("[CLIENT LOG] Creating file: %s\n", fullPath);
-        
-            FILE *fp = fopen(fullPath, "wb");
-            if (!fp) {
-                perror("[CLIENT ERROR] Failed to create file");
-                return;
-            }
-        
-            if (fileSize == 0) {
-                // Empty file case
-                fclose(fp);
-                printf("[CLIENT LOG] Empty file created: %s\n", fullPath);
             } else {
-                // Locate the start of file data in buffer
-                char *fileData = strchr(buffer, '$');
-                for (int i = 0; i < 2; i++) {  // Skip past "C$path$size$"
-                    fileData = strchr(fileData + 1, '$');
-                    if (!fileData) {
-                        printf("[CLIENT ERROR] Malformed data format.\n");
-                        fclose(fp);
-                        return;
+                char fullPath[PATH_MAX];
+                combine_paths(client_sync_dir, filePath, fullPath);
+
+                printf("[CLIENT LOG] Creating file: %s\n", fullPath);
+
+                FILE *fp = fopen(fullPath, "wb");
+                if (!fp) {
+                    perror("[CLIENT ERROR] Failed to create file");  // The body is still drained below
+                }
+
+                size_t written = receive_file_body(sock, fp, buffer + headerLen, bytes_received - headerLen, fileSize);
+                if (fp) {
+                    fclose(fp);
+
+                    if (written != (size_t)fileSize) {
+                        printf("[CLIENT ERROR] File write incomplete: Expected %d bytes, wrote %zu\n", fileSize, written);
+                    } else {
+                        printf("[CLIENT LOG] File written successfully: %s (%d bytes)\n", fullPath, fileSize);
                     }
                 }
-                fileData++;  // Move past last '$'
-        
-                // Write file data
-                size_t written = fwrite(fileData, 1, fileSize, fp);
-                fclose(fp);
-        
-                if (written != fileSize) {
-                    printf("[CLIENT ERROR] File write incomplete: Expected %d bytes, wrote %zu\n", fileSize, written);
+            }
+        }
+        else if (buffer[0] == 'M') {
+            // Local transport: the body arrives as a sealed memfd shared with other local clients
+            char filePath[PATH_MAX];
+            size_t fileSize;
+
+            if (sscanf(buffer, "M$%[^$]$%zu$", filePath, &fileSize) < 2 || body_fd < 0) {
+                printf("[CLIENT ERROR] Invalid file frame: %s\n", buffer);
+            } else {
+                char fullPath[PATH_MAX];
+                combine_paths(client_sync_dir, filePath, fullPath);
+
+                printf("[CLIENT LOG] Creating file: %s\n", fullPath);
+
+                int out_fd = open(fullPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (out_fd < 0) {
+                    perror("[CLIENT ERROR] Failed to create file");
                 } else {
-                    printf("[CLIENT LOG] File written successfully: %s (%d bytes)\n", fullPath, fileSize);
+                    // Copy in the kernel; the explicit offset leaves the shared file position untouched
+                    off_t offset = 0;
+                    while ((size_t)offset < fileSize) {
+                        if (sendfile(out_fd, body_fd, &offset, fileSize - offset) <= 0) {
+                            break;
+                        }
+                    }
+                    close(out_fd);
+
+                    if ((size_t)offset != fileSize) {
+                        printf("[CLIENT ERROR] File write incomplete: Expected %zu bytes, wrote %jd\n", fileSize, (intmax_t)offset);
+                    } else {
+                        printf("[CLIENT LOG] File written successfully: %s (%zu bytes)\n", fullPath, fileSize);
+                    }
                 }
             }
         }
         else if (buffer[0] == 'Z') {
             char dirPath[PATH_MAX];
-            sscanf(buffer, "Z$%[^$]", dirPath);
+            int parsed = sscanf(buffer, "Z$%[^$]", dirPath);
 
             char finPath[PATH_MAX];
             combine_paths(client_sync_dir, dirPath, finPath);
@@ -170,54 +412,68 @@ int main(int argc, char *argv[]) {
 
             if (mkdir(finPath, 0777) == 0) {
                 printf("[CLIENT LOG] Directory created: %s\n", finPath);
+            } else if (errno == ENOENT && parsed == 1 && is_safe_path(dirPath)) {
+                // The parent was removed, e.g. a subscriber below a directory that was moved away
+                create_dirs(client_sync_dir, dirPath);
             } else {
                 perror("[CLIENT ERROR] Directory creation failed");
             }
         }
         else if (buffer[0] == 'F') {
             char fromPath[PATH_MAX], toPath[PATH_MAX];
-            sscanf(buffer, "F$%[^$]$T$%[^$]", fromPath, toPath);
-
-            char fullFromPath[PATH_MAX], fullToPath[PATH_MAX];
-            combine_paths(client_sync_dir, fromPath, fullFromPath);
-            combine_paths(client_sync_dir, toPath, fullToPath);
+            if (sscanf(buffer, "F$%[^$]$T$%[^$]", fromPath, toPath) < 2) {
+                printf("[CLIENT ERROR] Invalid move format: %s\n", buffer);
+            } else {
+                char fullFromPath[PATH_MAX], fullToPath[PATH_MAX];
+                combine_paths(client_sync_dir, fromPath, fullFromPath);
+                combine_paths(client_sync_dir, toPath, fullToPath);
 
-            printf("[CLIENT LOG] Moving: %s -> %s\n", fullFromPath, fullToPath);
+                printf("[CLIENT LOG] Moving: %s -> %s\n", fullFromPath, fullToPath);
 
-            if (rename(fullFromPath, fullToPath) == 0) {
-                printf("[CLIENT LOG] Move successful: %s -> %s\n", fullFromPath, fullToPath);
-            } else {
-                perror("[CLIENT ERROR] Move failed");
+                if (rename(fullFromPath, fullToPath) == 0) {
+                    printf("[CLIENT LOG] Move successful: %s -> %s\n", fullFromPath, fullToPath);
+                } else {
+                    perror("[CLIENT ERROR] Move failed");
+                }
             }
         }
         else if (buffer[0] == 'D') {
             char filePath[PATH_MAX];
-            sscanf(buffer, "D$%[^$]", filePath);
-
-            char finPath[PATH_MAX];
-            combine_paths(client_sync_dir, filePath, finPath);
-
-            printf("[CLIENT LOG] Deleting file/directory: %s\n", finPath);
 
-            struct stat path_stat;
-            if (stat(finPath, &path_stat) == 0) {
-                if (S_ISDIR(path_stat.st_mode)) {
-                    if (rmdir(finPath) == 0) {
-                        printf("[CLIENT LOG] Directory deleted: %s\n", finPath);
+            // Deletes can be recursive, so only act on a well-formed path inside the sync dir
+            if (sscanf(buffer, "D$%[^$]", filePath) != 1 || !is_safe_path(filePath)) {
+                printf("[CLIENT ERROR] Invalid delete path: %s\n", buffer);
+            } else {
+                char finPath[PATH_MAX];
+                combine_paths(client_sync_dir, filePath, finPath);
+
+                printf("[CLIENT LOG] Deleting file/directory: %s\n", finPath);
+
+                struct stat path_stat;
+                if (lstat(finPath, &path_stat) == 0) {
+                    if (S_ISDIR(path_stat.st_mode)) {
+                        // A directory moved out of view is removed with its contents
+                        if (remove_tree(finPath) == 0) {
+                            printf("[CLIENT LOG] Directory deleted: %s\n", finPath);
+                        } else {
+                            perror("[CLIENT ERROR] Directory deletion failed");
+                        }
                     } else {
-                        perror("[CLIENT ERROR] Directory deletion failed");
+                        if (remove(finPath) == 0) {
+                            printf("[CLIENT LOG] File deleted: %s\n", finPath);
+                        } else {
+                            perror("[CLIENT ERROR] File deletion failed");
+                        }
                     }
                 } else {
-                    if (remove(finPath) == 0) {
-                        printf("[CLIENT LOG] File deleted: %s\n", finPath);
-                    } else {
-                        perror("[CLIENT ERROR] File deletion failed");
-                    }
+                    perror("[CLIENT ERROR] File/Directory does not exist");
                 }
-            } else {
-                perror("[CLIENT ERROR] File/Directory does not exist");
             }
         }
+
+        if (body_fd >= 0) {
+            close(body_fd);
+        }
     }
 
     close(sock);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // memfd_create
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -5,10 +6,16 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <sys/inotify.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <poll.h>
 
 
 #define MAX_WATCHES 1024  // Max number of directories to watch
@@ -21,19 +28,38 @@ pthread_mutex_t wd_map_lock = PTHREAD_MUTEX_INITIALIZER;  // Mutex for thread sa
 #define EVENT_SIZE (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (1024 * (EVENT_SIZE + 16))
 #define MAX_IGNORE_ENTRIES 100
+#define MAX_SUBSCRIPTIONS 32
 
 // Struct to store client data
 typedef struct {
     int socket;
     char *ignore_list[MAX_IGNORE_ENTRIES]; // Stores ignore paths
     int ignore_count;
+    bool local;  // Connected over the Unix domain socket, receives file bodies as memfds
+    char *subscriptions[MAX_SUBSCRIPTIONS];  // Subscribed path prefixes relative to sync_dir
+    int subscription_count;
+    unsigned long dispatch_seq;  // Last event this client was routed, so it is sent each event once
 } Client;
 
-Client *clients;
+// Routing trie node: one path component and the clients subscribed to the subtree it names
+typedef struct TrieNode {
+    char *name;
+    struct TrieNode *children;  // First child
+    struct TrieNode *next;      // Next sibling
+    Client **subscribers;
+    int subscriber_count;
+    int subscriber_capacity;
+} TrieNode;
+
+Client **clients;  // Heap-allocated so the routing trie can hold stable pointers
+Client **route_targets;  // Scratch list of interested clients for the event being dispatched (2 * max_clients)
+TrieNode route_root;  // Empty prefix, i.e. clients subscribed to the whole sync_dir
+unsigned long dispatch_seq = 0;
 int client_count = 0;
 int max_clients;
 int server_port;
 char sync_dir[PATH_MAX];
+char local_socket_path[PATH_MAX];  // Empty when the local transport is disabled
 
 pthread_mutex_t lock;
 
@@ -41,22 +67,190 @@ pthread_mutex_t lock;
 void print_clients() {
     printf("\nCurrent Connected Clients (%d/%d):\n", client_count, max_clients);
     for (int i = 0; i < client_count; i++) {
-        printf("Client %d | Socket: %d\n", i + 1, clients[i].socket);
+        printf("Client %d | Socket: %d | %s\n", i + 1, clients[i]->socket, clients[i]->local ? "local" : "tcp");
+        for (int j = 0; j < clients[i]->subscription_count; j++) {
+            printf("  subscribed: /%s\n", clients[i]->subscriptions[j]);
+        }
     }
     printf("---------------------------------\n");
 }
 
+// Find the child of node named by the first len bytes of name, optionally creating it
+TrieNode *trie_child(TrieNode *node, const char *name, size_t len, bool create) {
+    for (TrieNode *child = node->children; child; child = child->next) {
+        if (strlen(child->name) == len && strncmp(child->name, name, len) == 0) {
+            return child;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    TrieNode *child = calloc(1, sizeof(TrieNode));
+    child->name = strndup(name, len);
+    child->next = node->children;
+    node->children = child;
+    return child;
+}
+
+// Add client to the subscriber set of the node for prefix (caller holds lock)
+void trie_subscribe(const char *prefix, Client *client) {
+    TrieNode *node = &route_root;
+    while (*prefix) {
+        size_t len = strcspn(prefix, "/");
+        if (len > 0) {
+            node = trie_child(node, prefix, len, true);
+        }
+        prefix += len + (prefix[len] == '/');
+    }
+
+    if (node->subscriber_count == node->subscriber_capacity) {
+        node->subscriber_capacity = node->subscriber_capacity ? node->subscriber_capacity * 2 : 4;
+        node->subscribers = realloc(node->subscribers, node->subscriber_capacity * sizeof(Client *));
+    }
+    node->subscribers[node->subscriber_count++] = client;
+}
+
+// Remove client from the node for prefix, pruning nodes left with no subscribers or children.
+// Returns true when node itself is now empty (caller holds lock).
+bool trie_unsubscribe(TrieNode *node, const char *prefix, Client *client) {
+    while (*prefix == '/') prefix++;
+
+    if (*prefix == '\0') {
+        for (int i = 0; i < node->subscriber_count; i++) {
+            if (node->subscribers[i] == client) {
+                node->subscribers[i] = node->subscribers[--node->subscriber_count];
+                break;
+            }
+        }
+    } else {
+        size_t len = strcspn(prefix, "/");
+        TrieNode **link = &node->children;
+        while (*link && !(strlen((*link)->name) == len && strncmp((*link)->name, prefix, len) == 0)) {
+            link = &(*link)->next;
+        }
+        if (*link && trie_unsubscribe(*link, prefix + len, client)) {
+            TrieNode *empty = *link;
+            *link = empty->next;
+            free(empty->name);
+            free(empty->subscribers);
+            free(empty);
+        }
+    }
+    return node->subscriber_count == 0 && node->children == NULL;
+}
+
+// Append the subscribers of node not yet routed for the current dispatch to route_targets
+int route_node(TrieNode *node, int target_count) {
+    for (int i = 0; i < node->subscriber_count; i++) {
+        Client *client = node->subscribers[i];
+        if (client->dispatch_seq != dispatch_seq) {
+            client->dispatch_seq = dispatch_seq;
+            route_targets[target_count++] = client;
+        }
+    }
+    return target_count;
+}
+
+// Append to route_targets every client subscribed to rel_path or one of its ancestors.
+// Only the nodes on the path are visited, so cost follows the interested subscribers.
+int route_event(const char *rel_path, int target_count) {
+    TrieNode *node = &route_root;
+    while (node) {
+        target_count = route_node(node, target_count);
+
+        while (*rel_path == '/') rel_path++;
+        if (*rel_path == '\0') {
+            break;
+        }
+        size_t len = strcspn(rel_path, "/");
+        node = trie_child(node, rel_path, len, false);
+        rel_path += len;
+    }
+    return target_count;
+}
+
+// Append the subscribers of every node below node (its children, their children, ...)
+int route_descendants(TrieNode *node, int target_count) {
+    for (TrieNode *child = node->children; child; child = child->next) {
+        target_count = route_node(child, target_count);
+        target_count = route_descendants(child, target_count);
+    }
+    return target_count;
+}
+
+// Route to subscribers of rel_path that do not also see exclude_path (if not NULL)
+int route_excluding(const char *rel_path, const char *exclude_path) {
+    dispatch_seq++;
+    if (exclude_path) {
+        route_event(exclude_path, 0);  // Only marks them, the list itself is overwritten below
+    }
+    return route_event(rel_path, 0);
+}
+
+// Route a move to the clients that see both of its sides
+int route_both(const char *from_path, const char *to_path) {
+    dispatch_seq++;
+    int to_count = route_event(to_path, 0);
+    dispatch_seq++;
+    route_event(from_path, to_count);  // Re-marks the subscribers of from_path
+
+    int both_count = 0;
+    for (int i = 0; i < to_count; i++) {
+        if (route_targets[i]->dispatch_seq == dispatch_seq) {
+            route_targets[both_count++] = route_targets[i];
+        }
+    }
+    return both_count;
+}
+
+// Route the removal of from_path: its subscribers, including those subscribed somewhere
+// below it, except clients that also see to_path (if not NULL) and get the rename instead
+int route_removal(const char *from_path, const char *to_path) {
+    int both_count = to_path ? route_both(from_path, to_path) : 0;
+
+    dispatch_seq++;
+    for (int i = 0; i < both_count; i++) {
+        route_targets[i]->dispatch_seq = dispatch_seq;
+    }
+    int target_count = route_event(from_path, 0);
+
+    TrieNode *node = &route_root;
+    while (node) {
+        while (*from_path == '/') from_path++;
+        if (*from_path == '\0') {
+            return route_descendants(node, target_count);
+        }
+        size_t len = strcspn(from_path, "/");
+        node = trie_child(node, from_path, len, false);
+        from_path += len;
+    }
+    return target_count;
+}
+
+// Free a client and its ignore list and subscription entries
+void free_client(Client *client) {
+    for (int j = 0; j < client->ignore_count; j++) {
+        free(client->ignore_list[j]);  // Free each ignore entry
+    }
+    for (int j = 0; j < client->subscription_count; j++) {
+        free(client->subscriptions[j]);
+    }
+    free(client);
+}
+
 void remove_client(int client_sock) {
     pthread_mutex_lock(&lock);
     for (int i = 0; i < client_count; i++) {
-        if (clients[i].socket == client_sock) {
+        if (clients[i]->socket == client_sock) {
             printf("Client (Socket: %d) disconnected\n", client_sock);
             close(client_sock);
 
-            // Free allocated ignore list entries
-            for (int j = 0; j < clients[i].ignore_count; j++) {
-                free(clients[i].ignore_list[j]);  // Free each ignore entry
+            // Drop the client from the routing trie before freeing it
+            for (int j = 0; j < clients[i]->subscription_count; j++) {
+                trie_unsubscribe(&route_root, clients[i]->subscriptions[j], clients[i]);
             }
+            free_client(clients[i]);
 
             // Shift remaining clients down
             for (int j = i; j < client_count - 1; j++) {
@@ -140,20 +334,248 @@ bool checkignore(char* message, char* ignore_list) {
     return true; // Allow the file
 }
 
-// Broadcast a message to all connected clients
-void broadcast_message(const char *message) {
-    pthread_mutex_lock(&lock);
-    for (int i = 0; i < client_count; i++) {
-        if(checkignore(message, clients[i].ignore_list[0])){
-            if (send(clients[i].socket, message, strlen(message), 0) < 0) {
+// Send a message to the first target_count route_targets (caller holds lock)
+void send_to_targets(const char *message, int target_count) {
+    for (int i = 0; i < target_count; i++) {
+        Client *client = route_targets[i];
+        if(checkignore((char *)message, client->ignore_list[0])){
+            if (send(client->socket, message, strlen(message), MSG_NOSIGNAL) < 0) {
+                // The client's handler thread notices the disconnect and removes it
                 perror("Failed to send message to client");
-                remove_client(clients[i].socket);
             }
         }
     }
+}
+
+// Broadcast a message to the clients subscribed to rel_path
+void broadcast_message(const char *message, const char *rel_path) {
+    pthread_mutex_lock(&lock);
+    send_to_targets(message, route_excluding(rel_path, NULL));
+    pthread_mutex_unlock(&lock);
+}
+
+// Broadcast a rename to the clients that see both from_path and to_path
+void broadcast_move(const char *message, const char *from_path, const char *to_path) {
+    pthread_mutex_lock(&lock);
+    send_to_targets(message, route_both(from_path, to_path));
     pthread_mutex_unlock(&lock);
 }
 
+// Broadcast the removal of from_path (see route_removal)
+void broadcast_removal(const char *message, const char *from_path, const char *to_path) {
+    pthread_mutex_lock(&lock);
+    send_to_targets(message, route_removal(from_path, to_path));
+    pthread_mutex_unlock(&lock);
+}
+
+// Copy a file into a sealed memfd so all local clients can share one snapshot of its body
+int create_file_snapshot(const char *path, size_t *snapshot_size) {
+    int src = open(path, O_RDONLY);
+    if (src < 0) {
+        perror("open failed");
+        return -1;
+    }
+
+    int memfd = memfd_create("syncbody", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        perror("memfd_create failed");
+        close(src);
+        return -1;
+    }
+
+    // Kernel-side copy until EOF, so a file that changed since stat() is still captured whole
+    off_t offset = 0;
+    ssize_t copied;
+    while ((copied = sendfile(memfd, src, &offset, 1 << 20)) > 0);
+    close(src);
+
+    if (copied < 0) {
+        perror("sendfile failed");
+        close(memfd);
+        return -1;
+    }
+
+    // Seal the snapshot so clients never observe a body that changes under them
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        perror("fcntl F_ADD_SEALS failed");
+    }
+
+    *snapshot_size = offset;
+    return memfd;
+}
+
+// Send a control frame with a file descriptor attached (SCM_RIGHTS)
+int send_with_fd(int sock, const char *message, int fd) {
+    struct iovec iov = { .iov_base = (void *)message, .iov_len = strlen(message) };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+// Build "C$path$size$<body>" on the heap for TCP clients, reading the body from fd
+char *build_inline_message(const char *rel_path, int fd, size_t *message_len) {
+    struct stat fd_stat;
+    size_t file_size = (fd >= 0 && fstat(fd, &fd_stat) == 0) ? fd_stat.st_size : 0;
+
+    char header[BUFFER_SIZE];
+    int header_len = snprintf(header, BUFFER_SIZE, "C$%s$%zu$", rel_path, file_size);
+
+    char *message = malloc(header_len + file_size + 1);
+    if (!message) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    memcpy(message, header, header_len);
+
+    size_t body_len = 0;
+    while (body_len < file_size) {
+        ssize_t bytes_read = pread(fd, message + header_len + body_len, file_size - body_len, body_len);
+        if (bytes_read <= 0) {
+            break;
+        }
+        body_len += bytes_read;
+    }
+
+    if (body_len != file_size) {
+        // The file shrank while being read, send it as empty rather than with a wrong size
+        fprintf(stderr, "Short read of %s, sending empty body\n", rel_path);
+        header_len = snprintf(message, header_len + 1, "C$%s$0$", rel_path);
+        body_len = 0;
+    }
+
+    message[header_len + body_len] = '\0';
+    *message_len = header_len + body_len;
+    return message;
+}
+
+// Broadcast a created file. Local clients get a small "M$path$size$" frame carrying a memfd
+// that is filled once and shared by all of them, TCP clients get the inline message.
+// The file is read without holding the client lock. Subscribers that also see exclude_path
+// (if not NULL) are skipped, e.g. because they already got a rename for it.
+void broadcast_file(const char *event_path, const char *rel_path, const char *exclude_path) {
+    char header[BUFFER_SIZE];
+    snprintf(header, BUFFER_SIZE, "C$%s$", rel_path);  // Used for the extension check
+
+    // Find out which transports the interested clients use
+    bool want_snapshot = false;
+    bool want_inline = false;
+    pthread_mutex_lock(&lock);
+    int target_count = route_excluding(rel_path, exclude_path);
+    for (int i = 0; i < target_count; i++) {
+        if (checkignore(header, route_targets[i]->ignore_list[0])) {
+            if (route_targets[i]->local) {
+                want_snapshot = true;
+            } else {
+                want_inline = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!want_snapshot && !want_inline) {
+        return;
+    }
+
+    int memfd = -1;
+    size_t snapshot_size = 0;
+    if (want_snapshot) {
+        memfd = create_file_snapshot(event_path, &snapshot_size);
+    }
+
+    // When a snapshot exists the inline body is read from it instead of from disk again.
+    // Local clients never get the inline message, it would not fit in one SOCK_SEQPACKET frame.
+    char *inline_message = NULL;
+    size_t inline_len = 0;
+    if (want_inline) {
+        int src = memfd >= 0 ? memfd : open(event_path, O_RDONLY);
+        inline_message = build_inline_message(rel_path, src, &inline_len);
+        if (src >= 0 && src != memfd) {
+            close(src);
+        }
+    }
+
+    char frame[BUFFER_SIZE];
+    snprintf(frame, BUFFER_SIZE, "M$%s$%zu$", rel_path, snapshot_size);
+
+    // Route again, clients may have connected or disconnected while the file was read
+    pthread_mutex_lock(&lock);
+    target_count = route_excluding(rel_path, exclude_path);
+    for (int i = 0; i < target_count; i++) {
+        Client *client = route_targets[i];
+        if (!checkignore(header, client->ignore_list[0])) {
+            continue;
+        }
+
+        int result;
+        if (client->local) {
+            if (memfd < 0) {
+                fprintf(stderr, "No snapshot of %s for local client %d, file dropped\n", rel_path, client->socket);
+                continue;
+            }
+            result = send_with_fd(client->socket, frame, memfd);
+        } else if (inline_message) {
+            result = send(client->socket, inline_message, inline_len, MSG_NOSIGNAL);
+        } else {
+            continue;  // Joined after the body was prepared for the other transport
+        }
+        if (result < 0) {
+            // The client's handler thread notices the disconnect and removes it
+            perror("Failed to send message to client");
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    free(inline_message);
+    if (memfd >= 0) {
+        close(memfd);  // Each local client now holds its own reference
+    }
+}
+
+// Broadcast a file or directory tree that appeared at event_path (e.g. moved in) as creates
+void broadcast_tree(const char *event_path, const char *rel_path, const char *exclude_path) {
+    struct stat path_stat;
+    if (stat(event_path, &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)) {
+        broadcast_file(event_path, rel_path, exclude_path);
+        return;
+    }
+
+    char message[BUFFER_SIZE];
+    snprintf(message, BUFFER_SIZE, "Z$%s$", rel_path);
+    pthread_mutex_lock(&lock);
+    send_to_targets(message, route_excluding(rel_path, exclude_path));
+    pthread_mutex_unlock(&lock);
+
+    DIR *dir = opendir(event_path);
+    if (!dir) {
+        perror("opendir failed");
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+            char entry_path[PATH_MAX], entry_rel_path[PATH_MAX];
+            snprintf(entry_path, PATH_MAX, "%s/%s", event_path, entry->d_name);
+            snprintf(entry_rel_path, PATH_MAX, "%s/%s", rel_path, entry->d_name);
+            broadcast_tree(entry_path, entry_rel_path, exclude_path);
+        }
+    }
+    closedir(dir);
+}
+
 void add_watch_recursive(int inotify_fd, const char *dir_path) {
     DIR *dir = opendir(dir_path);
     if (!dir) {
@@ -220,6 +642,19 @@ void strip_server_path(const char *server_path, const char *event_path, char *re
     }
 }
 
+// A moved-from path whose IN_MOVED_TO never arrived has left sync_dir, so treat it as removed
+void flush_moved_from(char *moved_from) {
+    if (moved_from[0] == '\0') {
+        return;
+    }
+
+    char message[BUFFER_SIZE];
+    snprintf(message, BUFFER_SIZE, "D$%s", moved_from);
+    printf("[SERVER LOG] File/Directory Moved Out: %s\n", moved_from);
+    broadcast_removal(message, moved_from, NULL);
+    moved_from[0] = '\0';
+}
+
 // Thread function to monitor the sync directory
 void *monitor_directory(void *arg) {
     int inotify_fd = inotify_init();
@@ -230,6 +665,8 @@ void *monitor_directory(void *arg) {
 
     add_watch_recursive(inotify_fd, sync_dir);
     char buffer[EVENT_BUF_LEN];
+    char moved_from[PATH_MAX] = "";  // Pending IN_MOVED_FROM, paired with IN_MOVED_TO by cookie
+    uint32_t moved_cookie = 0;
 
     while (1) {
         int length = read(inotify_fd, buffer, EVENT_BUF_LEN);
@@ -241,6 +678,9 @@ void *monitor_directory(void *arg) {
         int i = 0;
         while (i < length) {
             struct inotify_event *event = (struct inotify_event *)&buffer[i];
+            if (moved_from[0] && !((event->mask & IN_MOVED_TO) && event->cookie == moved_cookie)) {
+                flush_moved_from(moved_from);
+            }
             if (event->len) {
                 char event_path[PATH_MAX];
                // Get directory path associated with watch descriptor
@@ -259,67 +699,17 @@ void *monitor_directory(void *arg) {
                         char rel_path[PATH_MAX];
                         strip_server_path(sync_dir, event_path, rel_path);
 
-                        if(is_directory(event_path)){
-                            snprintf(message, BUFFER_SIZE, "Z$%s$", rel_path);
-                        }
-                        else{
-                            // Read file data
-                            FILE *file = fopen(event_path, "rb");
-                            if (file) {
-                                size_t file_size = path_stat.st_size;
-                                char *file_data = malloc(file_size);
-                                if (file_data) {
-                                    fread(file_data, 1, file_size, file);
-                                    fclose(file);
-
-                                    // Create message with file data
-                                    int header_len = snprintf(message, BUFFER_SIZE, "C$%s$%zu$", rel_path, file_size);
-                                    memcpy(message + header_len, file_data, file_size);
-
-                                    free(file_data);
-                                } else {
-                                    fclose(file);
-                                    snprintf(message, BUFFER_SIZE, "C$%s$0$", rel_path);
-                                }
-                            } else {
-                                snprintf(message, BUFFER_SIZE, "C$%s$0$", rel_path);
-                            }
-                        }
+                        snprintf(message, BUFFER_SIZE, "Z$%s$", rel_path);
                         printf("[SERVER LOG] Directory Created: %s\n", event_path);
-                        broadcast_message(message);
+                        broadcast_message(message, rel_path);
                         add_watch_recursive(inotify_fd, event_path);
                     } else {
                         char rel_path[PATH_MAX];
                         strip_server_path(sync_dir, event_path, rel_path);
 
-                        if(is_directory(event_path)){
-                            snprintf(message, BUFFER_SIZE, "Z$%s$", rel_path);
-                        }
-                        else{
-                            // Read file data
-                            FILE *file = fopen(event_path, "rb");
-                            if (file) {
-                                size_t file_size = path_stat.st_size;
-                                char *file_data = malloc(file_size);
-                                if (file_data) {
-                                    fread(file_data, 1, file_size, file);
-                                    fclose(file);
-
-                                    // Create message with file data
-                                    int header_len = snprintf(message, BUFFER_SIZE, "C$%s$%zu$", rel_path, file_size);
-                                    memcpy(message + header_len, file_data, file_size);
-
-                                    free(file_data);
-                                } else {
-                                    fclose(file);
-                                    snprintf(message, BUFFER_SIZE, "C$%s$0$", rel_path);
-                                }
-                            } else {
-                                snprintf(message, BUFFER_SIZE, "C$%s$0$", rel_path);
-                            }
-                        }
+                        // The body is read by broadcast_file, once, for whichever transports need it
                         printf("[SERVER LOG] File Created: %s\n", event_path);
-                        broadcast_message(message);
+                        broadcast_file(event_path, rel_path, NULL);
                     }
                 }
                 if (event->mask & IN_DELETE) {
@@ -341,26 +731,41 @@ void *monitor_directory(void *arg) {
                     }
 
                     printf("[SERVER LOG] File/Directory Deleted: %s\n", event_path);
-                    broadcast_message(message);
+                    if (event->mask & IN_ISDIR) {
+                        // Also reaches clients subscribed below the deleted directory
+                        broadcast_removal(message, rel_path, NULL);
+                    } else {
+                        broadcast_message(message, rel_path);
+                    }
                 }
 
-                int offset;
-
                 if (event->mask & IN_MOVED_FROM) {
                     char rel_path[PATH_MAX];
                     strip_server_path(sync_dir, event_path, rel_path);
 
-                    offset = snprintf(message, BUFFER_SIZE, "F$%s$", rel_path);
+                    strcpy(moved_from, rel_path);  // Kept until the matching IN_MOVED_TO event
+                    moved_cookie = event->cookie;
                     printf("[SERVER LOG] File/Directory Moved From: %s\n", event_path);
-                    //broadcast_message(message);
                 }
                 if (event->mask & IN_MOVED_TO) {
                     char rel_path[PATH_MAX];
                     strip_server_path(sync_dir, event_path, rel_path);
 
-                    snprintf(message+offset, BUFFER_SIZE, "T$%s", rel_path);
                     printf("[SERVER LOG] File/Directory Moved To: %s\n", event_path);
-                    broadcast_message(message);
+                    if (moved_from[0]) {
+                        // Clients seeing both sides rename, clients seeing one side delete or create
+                        snprintf(message, BUFFER_SIZE, "F$%s$T$%s", moved_from, rel_path);
+                        broadcast_move(message, moved_from, rel_path);
+
+                        snprintf(message, BUFFER_SIZE, "D$%s", moved_from);
+                        broadcast_removal(message, moved_from, rel_path);
+
+                        broadcast_tree(event_path, rel_path, moved_from);
+                        moved_from[0] = '\0';
+                    } else {
+                        // Moved in from outside sync_dir
+                        broadcast_tree(event_path, rel_path, NULL);
+                    }
                     struct stat path_stat;
                     if (stat(event_path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
                         add_watch_recursive(inotify_fd, event_path);
@@ -369,59 +774,222 @@ void *monitor_directory(void *arg) {
             }
             i += EVENT_SIZE + event->len;
         }
+
+        // The matching IN_MOVED_TO may still be queued, wait briefly before calling it a move out
+        if (moved_from[0] && poll(&(struct pollfd){ .fd = inotify_fd, .events = POLLIN }, 1, 10) <= 0) {
+            flush_moved_from(moved_from);
+        }
     }
     close(inotify_fd);
     return NULL;
 }
 
-void receive_ignore_list(int client_sock, Client *client) {
+// Drop empty and "." components of a subscription prefix in place, so "./docs/" becomes "docs".
+// Returns false if the prefix contains "..", which would never match an event.
+bool normalize_prefix(char *prefix) {
+    char normalized[PATH_MAX];
+    size_t offset = 0;
+
+    for (const char *component = prefix; *component; ) {
+        size_t len = strcspn(component, "/");
+        if (len == 2 && strncmp(component, "..", 2) == 0) {
+            return false;
+        }
+        if (len > 0 && !(len == 1 && component[0] == '.')) {
+            if (offset > 0) {
+                normalized[offset++] = '/';
+            }
+            memcpy(normalized + offset, component, len);
+            offset += len;
+        }
+        component += len + (component[len] == '/');
+    }
+
+    normalized[offset] = '\0';
+    strcpy(prefix, normalized);
+    return true;
+}
+
+// Receive the client's handshake: "IGNORE$ext,...", optionally followed by ";SUBSCRIBE$prefix,...".
+// Returns true if the client asked for subscriptions, even if none of its prefixes were valid.
+bool receive_handshake(int client_sock, Client *client) {
     char buffer[BUFFER_SIZE];
     memset(buffer, 0, BUFFER_SIZE);
 
-    if (recv(client_sock, buffer, BUFFER_SIZE, 0) <= 0) {
+    client->ignore_count = 0;
+    client->subscription_count = 0;
+    client->dispatch_seq = 0;
+
+    if (recv(client_sock, buffer, BUFFER_SIZE - 1, 0) <= 0) {
         perror("Failed to receive ignore list");
-        return;
+        return false;
     }
 
-    client->ignore_count = 0;
-    char *token = strtok(buffer, ";");
-    while (token && client->ignore_count < MAX_IGNORE_ENTRIES) {
-        client->ignore_list[client->ignore_count] = strdup(token);
-        client->ignore_count++;
-        token = strtok(NULL, ";");
+    bool subscribe_requested = false;
+    char *save_ptr;
+    char *token = strtok_r(buffer, ";", &save_ptr);
+    while (token) {
+        if (strncmp(token, "SUBSCRIBE$", 10) == 0) {
+            subscribe_requested = true;
+            char *prefix_ptr;
+            char *prefix = strtok_r(token + 10, ",", &prefix_ptr);
+            while (prefix && client->subscription_count < MAX_SUBSCRIPTIONS) {
+                if (normalize_prefix(prefix)) {
+                    client->subscriptions[client->subscription_count++] = strdup(prefix);
+                } else {
+                    printf("[SERVER LOG] Rejected subscription prefix \"%s\" from Client %d\n", prefix, client_sock);
+                }
+                prefix = strtok_r(NULL, ",", &prefix_ptr);
+            }
+        } else if (client->ignore_count < MAX_IGNORE_ENTRIES) {
+            client->ignore_list[client->ignore_count] = strdup(token);
+            client->ignore_count++;
+        }
+        token = strtok_r(NULL, ";", &save_ptr);
     }
 
     printf("[SERVER LOG] Received Ignore List for Client %d:\n", client_sock);
     for (int i = 0; i < client->ignore_count; i++) {
         printf("  - %s\n", client->ignore_list[i]);
     }
+    return subscribe_requested;
+}
+
+// Register an accepted client and start its handler thread
+void register_client(int client_sock, bool local) {
+    // The handshake is read before taking the lock, so a client that never sends it
+    // cannot stall the other listener or the broadcasts
+    Client *client = calloc(1, sizeof(Client));
+    client->socket = client_sock;
+    client->local = local;
+    bool subscribe_requested = receive_handshake(client_sock, client); // Receive ignore list and subscriptions
+
+    // No subscriptions means the whole sync_dir, i.e. the trie root. A client that asked for
+    // subtrees but sent no valid prefix gets nothing, never the whole tree.
+    if (!subscribe_requested) {
+        client->subscriptions[client->subscription_count++] = strdup("");
+    } else if (client->subscription_count == 0) {
+        printf("[SERVER LOG] Client %d has no valid subscription prefix, no events will be sent\n", client_sock);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (client_count < max_clients) {
+        for (int i = 0; i < client->subscription_count; i++) {
+            trie_subscribe(client->subscriptions[i], client);
+        }
+        clients[client_count++] = client;
+
+        pthread_t client_thread;
+        int *new_sock = malloc(sizeof(int));
+        *new_sock = client_sock;
+        pthread_create(&client_thread, NULL, handle_client, new_sock);
+        pthread_detach(client_thread);  // Automatically clean up thread
+
+        print_clients();
+    } else {
+        close(client_sock);
+        free_client(client);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Thread function to register one accepted client, so a slow handshake only delays itself
+void *register_client_thread(void *arg) {
+    int client_sock = ((int *)arg)[0];
+    bool local = ((int *)arg)[1];
+    free(arg);
+
+    register_client(client_sock, local);
+    return NULL;
+}
+
+// Hand an accepted client to its own registration thread
+void start_registration(int client_sock, bool local) {
+    pthread_t register_thread;
+    int *args = malloc(2 * sizeof(int));
+    args[0] = client_sock;
+    args[1] = local;
+    pthread_create(&register_thread, NULL, register_client_thread, args);
+    pthread_detach(register_thread);  // Automatically clean up thread
+}
+
+// Thread function to accept same-host clients on the Unix domain socket.
+// SOCK_SEQPACKET keeps one message per frame, so a passed memfd stays attached to its header.
+void *accept_local_clients(void *arg) {
+    int local_sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (local_sock < 0) {
+        perror("Local socket creation failed");
+        return NULL;
+    }
+
+    struct sockaddr_un local_addr;
+    memset(&local_addr, 0, sizeof(local_addr));
+    local_addr.sun_family = AF_UNIX;
+    strncpy(local_addr.sun_path, local_socket_path, sizeof(local_addr.sun_path) - 1);
+
+    // Remove a stale socket left by a previous run, but never anything else at that path
+    struct stat path_stat;
+    if (lstat(local_socket_path, &path_stat) == 0) {
+        if (!S_ISSOCK(path_stat.st_mode)) {
+            fprintf(stderr, "Local socket path %s exists and is not a socket\n", local_socket_path);
+            close(local_sock);
+            return NULL;
+        }
+        unlink(local_socket_path);
+    }
+    if (bind(local_sock, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
+        perror("Local socket bind failed");
+        close(local_sock);
+        return NULL;
+    }
+    listen(local_sock, max_clients);
+    printf("Server listening on local socket %s...\n", local_socket_path);
+
+    while (1) {
+        int client_sock = accept(local_sock, NULL, NULL);
+        if (client_sock < 0) continue;
+
+        start_registration(client_sock, true);
+    }
+
+    close(local_sock);
+    return NULL;
 }
 
 int main(int argc, char *argv[]) {
     if (argc < 4) {
-        printf("Usage: %s <server_dir_path> <port> <max_clients>\n", argv[0]);
+        printf("Usage: %s <server_dir_path> <port> <max_clients> [local_socket_path]\n", argv[0]);
         return 1;
     }
 
     strncpy(sync_dir, argv[1], PATH_MAX);
     server_port = atoi(argv[2]);
     max_clients = atoi(argv[3]); // Taking max_clients from command-line argument
+    if (argc > 4) {
+        strncpy(local_socket_path, argv[4], PATH_MAX - 1);  // Enables the same-host transport
+    }
 
     int server_sock, client_sock;
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_size = sizeof(client_addr);
-    pthread_t monitor_thread;
+    pthread_t monitor_thread, local_thread;
 
     pthread_mutex_init(&lock, NULL);
     pthread_create(&monitor_thread, NULL, monitor_directory, NULL);
     pthread_detach(monitor_thread);
 
-    clients = (Client *)malloc(max_clients * sizeof(Client)); // Allocate memory for clients
-    if (!clients) {
+    clients = (Client **)malloc(max_clients * sizeof(Client *)); // Allocate memory for clients
+    route_targets = (Client **)malloc(2 * max_clients * sizeof(Client *));  // route_both uses two lists
+    if (!clients || !route_targets) {
         perror("Memory allocation failed");
         return 1;
     }
 
+    if (local_socket_path[0] != '\0') {
+        pthread_create(&local_thread, NULL, accept_local_clients, NULL);
+        pthread_detach(local_thread);
+    }
+
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
     setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
 
@@ -437,28 +1005,13 @@ int main(int argc, char *argv[]) {
         client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_size);
         if (client_sock < 0) continue;
     
-        pthread_mutex_lock(&lock);
-        if (client_count < max_clients) {
-            clients[client_count].socket = client_sock;
-            receive_ignore_list(client_sock, &clients[client_count]); // Receive ignore list
-            client_count++;
-    
-            pthread_t client_thread;
-            int *new_sock = malloc(sizeof(int));
-            *new_sock = client_sock;
-            pthread_create(&client_thread, NULL, handle_client, new_sock);
-            pthread_detach(client_thread);  // Automatically clean up thread
-    
-            print_clients();
-        } else {
-            close(client_sock);
-        }
-        pthread_mutex_unlock(&lock);
+        start_registration(client_sock, false);
     }
     
 
     close(server_sock);
     free(clients); // Free allocated memory
+    free(route_targets);
     return 0;
 }
 